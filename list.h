@@ -112,25 +112,25 @@ void free_list(list *x, int free_data)
     free(x);
 }
 
-// Display a list. The type_of_print parameter differentiates
+// Display a list to out. The type_of_print parameter differentiates
 //      between the lists in stl and the allocated_memory list,
 //      which must be printed differently, as required by the DUMP_MEMORY model
-void print_list(list *x, int type_of_print)
+void print_list(list *x, int type_of_print, FILE *out)
 {
     if (!x)
         return;
     node *p = x->first;
     if (type_of_print == 0)
         while (p) {
-            printf(" 0x%lx", p->address);
+            fprintf(out, " 0x%lx", p->address);
             p = p->next;
         }
     else
         while (p) {
-            printf(" (0x%lx - %d)", p->address, p->size);
+            fprintf(out, " (0x%lx - %d)", p->address, p->size);
             p = p->next;
         }
-    printf("\n");
+    fprintf(out, "\n");
 }
 
 // This function removes a node from a list that it is already known to belong to
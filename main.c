@@ -1,9 +1,16 @@
 // Copyright Filip Popa ~ ACS 313CAb 2024
 
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include "list.h"
+#include "server.h"
+
+#define MAX_COMMAND_LENGTH 100
+#define MAX_LINE_LENGTH 1024
+// Every byte of the heap may become a block, so its size is bounded
+#define MAX_HEAP_SIZE (1 << 26)
 
 // Structure to store the necessary information for DUMP_MEMORY
 typedef struct {
@@ -122,11 +129,11 @@ void add_block_of_new_size_to_stl(sfl *x, node *p)
 }
 
 // Function for the MALLOC command
-void malloc_sfl(sfl *x, int nr_bytes, list *allocated_memory)
+void malloc_sfl(sfl *x, int nr_bytes, list *allocated_memory, FILE *out)
 {
     int i = position_in_sfl(x, nr_bytes);
     if (i == x->nr_lists) {
-        printf("Out of memory\n");
+        fprintf(out, "Out of memory\n");
         return;
     }
 
@@ -289,11 +296,12 @@ void try_to_tape(sfl *x, node *p)
 }
 
 // Function corresponding to the FREE command
-void free_from_memory(sfl *x, list *allocated_memory, size_t address)
+void free_from_memory(sfl *x, list *allocated_memory, size_t address,
+                      FILE *out)
 {
     node *p = remove_from_list(allocated_memory, address);
     if (!p) {
-        printf("Invalid free\n");
+        fprintf(out, "Invalid free\n");
         return;
     }
     free(p->data);
@@ -313,49 +321,42 @@ void free_from_memory(sfl *x, list *allocated_memory, size_t address)
 }
 
 // Function corresponding to the DUMP_MEMORY command
-void dump_memory(sfl *x, list *allocated_memory)
+void dump_memory(sfl *x, list *allocated_memory, FILE *out)
 {
-    printf("+++++DUMP+++++\n");
-    printf("Total memory: %d bytes\n", x->info->heap_size);
-    printf("Total allocated memory: %d bytes\n", x->info->allocated_bytes);
-    printf("Total free memory: %d bytes\n", x->info->free_bytes);
-    printf("Free blocks: %d\n", x->info->free_blocks);
-    printf("Number of allocated blocks: %d\n", x->info->nr_allocated_blocks);
-    printf("Number of malloc calls: %d\n", x->info->nr_malloc_calls);
-    printf("Number of fragmentations: %d\n", x->info->nr_fragmentations);
-    printf("Number of free calls: %d\n", x->info->nr_free_calls);
+    fprintf(out, "+++++DUMP+++++\n");
+    fprintf(out, "Total memory: %d bytes\n", x->info->heap_size);
+    fprintf(out, "Total allocated memory: %d bytes\n",
+            x->info->allocated_bytes);
+    fprintf(out, "Total free memory: %d bytes\n", x->info->free_bytes);
+    fprintf(out, "Free blocks: %d\n", x->info->free_blocks);
+    fprintf(out, "Number of allocated blocks: %d\n",
+            x->info->nr_allocated_blocks);
+    fprintf(out, "Number of malloc calls: %d\n", x->info->nr_malloc_calls);
+    fprintf(out, "Number of fragmentations: %d\n",
+            x->info->nr_fragmentations);
+    fprintf(out, "Number of free calls: %d\n", x->info->nr_free_calls);
 
     // Print the contents of the heap
     for (int i = 0; i < x->nr_lists; i++) {
-        printf("Blocks with %d bytes - %d free block(s) :",
-               x->lists[i]->data_size, size_of_list(x->lists[i]));
-        print_list(x->lists[i], 0);
+        fprintf(out, "Blocks with %d bytes - %d free block(s) :",
+                x->lists[i]->data_size, size_of_list(x->lists[i]));
+        print_list(x->lists[i], 0, out);
     }
 
-    printf("Allocated blocks :");
-    print_list(allocated_memory, 1);
-    printf("-----DUMP-----\n");
+    fprintf(out, "Allocated blocks :");
+    print_list(allocated_memory, 1, out);
+    fprintf(out, "-----DUMP-----\n");
 }
 
 // Function corresponding to the WRITE command. Returns -1 if I get
 //      "segmentation fault" or 0 if the operation was successful
-int write_sfl(list *allocated_memory, size_t address)
+// The data and nr_bytes arguments are already parsed by execute_command()
+int write_sfl(list *allocated_memory, size_t address, char *data,
+              size_t nr_bytes)
 {
     if (!allocated_memory)
         return -1;
 
-    // Read the input, which I will split with strtok
-    const int max_input_length = 650;
-    char input[max_input_length];
-    fgets(input, max_input_length, stdin);
-
-    // Split the input to build data
-    //      and calculate nr_bytes
-    strtok(input, "\n");
-    char *data = strtok(input, "\"");
-    data = strtok(NULL, "\"");
-    size_t nr_bytes = atoi(strtok(NULL, "\""));
-
     // Write at most all data
     if (nr_bytes > strlen(data))
         nr_bytes = strlen(data);
@@ -400,14 +401,13 @@ int write_sfl(list *allocated_memory, size_t address)
 
 // Function corresponding to the READ command. Returns -1 if I get
 //      "segmentation fault" or 0 if the operation was successful
-int read_sfl(list *allocated_memory)
+int read_sfl(list *allocated_memory, size_t save_address,
+             size_t save_nr_bytes, FILE *out)
 {
     // I need the save_ variables which I use in the for loop because
     //      the address, nr_bytes, and p variables change after
     //      the first traversal and I must not lose their values
     size_t address, nr_bytes;
-    size_t save_address, save_nr_bytes;
-    scanf("%lx%lu", &save_address, &save_nr_bytes);
 
     if (!allocated_memory)
         return -1;
@@ -444,7 +444,7 @@ int read_sfl(list *allocated_memory)
             char *c = (char *)(p->data);
             if (print)
                 for (size_t i = add_address; i < s + add_address; i++)
-                    printf("%c", *(c + i));
+                    fprintf(out, "%c", *(c + i));
 
             // Move to the next block
             nr_bytes -= s;
@@ -457,59 +457,244 @@ int read_sfl(list *allocated_memory)
     }
 
 	// Printing was valid, so return 0
-    printf("\n");
+    fprintf(out, "\n");
     return 0;
 }
 
-int main(void)
+// The state kept between commands: the sfl (NULL until INIT_HEAP) and the
+//      allocated blocks. In server mode the state outlives DESTROY_HEAP
+//      and invalid accesses, because the process serves other clients too
+typedef struct {
+    sfl *x;
+    list *allocated_memory;
+    int server_mode;
+} allocator;
+
+allocator *new_allocator(int server_mode)
 {
-	const int max_command_length = 100;
-	char *command = malloc(max_command_length * sizeof(char));
-	sfl *x;
-
-	// Store allocated memory in a list
-	list *allocated_memory = malloc(sizeof(list));
-	allocated_memory->first = NULL;
-	allocated_memory->data_size = 0;
-
-	while (1) {
-		scanf("%s", command);
-		if (!strcmp(command, "INIT_HEAP")) {
-			size_t address;
-			int nr_lists, bytes_per_list, type;
-			scanf("%lx%d%d%d", &address, &nr_lists, &bytes_per_list, &type);
-			x = init_heap(address, nr_lists, bytes_per_list, type);
-		} else if (!strcmp(command, "MALLOC")) {
-			int nr_bytes;
-			scanf("%d", &nr_bytes);
-			malloc_sfl(x, nr_bytes, allocated_memory);
-		} else if (!strcmp(command, "FREE")) {
-			size_t address;
-			scanf("%lx", &address);
-			free_from_memory(x, allocated_memory, address);
-		} else if (!strcmp(command, "READ")) {
-			if (read_sfl(allocated_memory)) {
-				printf("Segmentation fault (core dumped)\n");
-				dump_memory(x, allocated_memory);
-				break;
-			}
-		} else if (!strcmp(command, "WRITE")) {
-			size_t address;
-			scanf("%lx", &address);
-			if (write_sfl(allocated_memory, address)) {
-				printf("Segmentation fault (core dumped)\n");
-				dump_memory(x, allocated_memory);
-				break;
-			}
-		} else if (!strcmp(command, "DUMP_MEMORY")) {
-			dump_memory(x, allocated_memory);
-		} else if (!strcmp(command, "DESTROY_HEAP")) {
-			break;
-		}
+    allocator *a = malloc(sizeof(allocator));
+    a->x = NULL;
+    a->allocated_memory = calloc(1, sizeof(list));
+    a->server_mode = server_mode;
+    return a;
+}
+
+// Function corresponding to the DESTROY_HEAP command: frees the sfl and
+//      the allocated blocks, so that INIT_HEAP can be called again
+void destroy_heap(allocator *a)
+{
+    free_sfl(a->x);
+    free_list(a->allocated_memory, 1);
+    a->x = NULL;
+    a->allocated_memory = calloc(1, sizeof(list));
+}
+
+void free_allocator(allocator *a)
+{
+    free_sfl(a->x);
+    free_list(a->allocated_memory, 1);
+    free(a);
+}
+
+// Print the error for a command which cannot be executed. The normal mode
+//      ignores such commands silently, like the original program did,
+//      while in server mode every command needs a response
+void command_error(allocator *a, FILE *out, const char *message)
+{
+    if (a->server_mode)
+        fprintf(out, "%s\n", message);
+}
+
+// Every command except INIT_HEAP needs an initialized heap
+int heap_is_initialized(allocator *a, FILE *out)
+{
+    if (!a->x)
+        command_error(a, out, "Heap not initialized");
+    return a->x != NULL;
+}
+
+// Called when READ or WRITE access unallocated memory. Returns 1 if
+//      the program must stop (only outside of the server mode)
+int segmentation_fault(allocator *a, FILE *out)
+{
+    fprintf(out, "Segmentation fault (core dumped)\n");
+    dump_memory(a->x, a->allocated_memory, out);
+    return !a->server_mode;
+}
+
+// The normal mode only rejects the INIT_HEAP arguments which crash the
+//      program (the block size of the last list must fit in an int), and
+//      handles everything else like the original program did
+// The server mode also needs a power of two bytes_per_list, large enough for
+//      every list (8, 16, 32, ... bytes per block) to have at least one
+//      block, with a heap of at most MAX_HEAP_SIZE bytes
+int valid_heap_arguments(allocator *a, int nr_lists, int bytes_per_list)
+{
+    if (nr_lists <= 0 || nr_lists > 28 || bytes_per_list <= 0)
+        return 0;
+    if (!a->server_mode)
+        return 1;
+
+    if (bytes_per_list < 8 || (bytes_per_list & (bytes_per_list - 1)) ||
+        bytes_per_list > MAX_HEAP_SIZE / nr_lists)
+        return 0;
+
+    int max_lists = 1;
+    for (int p = 8; p != bytes_per_list; p *= 2)
+        max_lists++;
+    return nr_lists <= max_lists;
+}
+
+// Check the size argument of MALLOC, READ or WRITE. The server mode needs
+//      a positive size, while the normal mode only rejects the sizes below
+//      min_size (the ones which crash the program)
+int valid_size(allocator *a, long nr_bytes, long min_size)
+{
+    return a->server_mode ? nr_bytes > 0 : nr_bytes >= min_size;
+}
+
+// Parse and execute the command from a line of input, printing its output
+//      to out. Returns 1 if the program must stop, 0 otherwise
+int execute_command(allocator *a, char *line, FILE *out)
+{
+    // The command is at most MAX_COMMAND_LENGTH - 1 characters long
+    char command[MAX_COMMAND_LENGTH];
+    int length;
+    if (sscanf(line, "%99s%n", command, &length) != 1)
+        return 0;
+    char *args = line + length;
+
+    if (!strcmp(command, "INIT_HEAP")) {
+        size_t address;
+        int nr_lists, bytes_per_list, type;
+        if (sscanf(args, "%lx%d%d%d", &address, &nr_lists,
+                   &bytes_per_list, &type) != 4 ||
+            !valid_heap_arguments(a, nr_lists, bytes_per_list)) {
+            command_error(a, out, "Invalid command");
+        } else if (a->x && a->server_mode) {
+            command_error(a, out, "Heap already initialized");
+        } else {
+            // The normal mode replaces the heap, like the original program
+            free_sfl(a->x);
+            a->x = init_heap(address, nr_lists, bytes_per_list, type);
+        }
+    } else if (!strcmp(command, "MALLOC")) {
+        int nr_bytes;
+        if (sscanf(args, "%d", &nr_bytes) != 1 ||
+            !valid_size(a, nr_bytes, 0))
+            command_error(a, out, "Invalid command");
+        else if (heap_is_initialized(a, out))
+            malloc_sfl(a->x, nr_bytes, a->allocated_memory, out);
+    } else if (!strcmp(command, "FREE")) {
+        size_t address;
+        if (sscanf(args, "%lx", &address) != 1)
+            command_error(a, out, "Invalid command");
+        else if (heap_is_initialized(a, out))
+            free_from_memory(a->x, a->allocated_memory, address, out);
+    } else if (!strcmp(command, "READ")) {
+        size_t address;
+        long nr_bytes;
+        if (sscanf(args, "%lx%ld", &address, &nr_bytes) != 2 ||
+            !valid_size(a, nr_bytes, LONG_MIN))
+            command_error(a, out, "Invalid command");
+        else if (heap_is_initialized(a, out) &&
+                 read_sfl(a->allocated_memory, address, nr_bytes, out))
+            return segmentation_fault(a, out);
+    } else if (!strcmp(command, "WRITE")) {
+        // The arguments look like: address "data" nr_bytes
+        size_t address;
+        long nr_bytes;
+        char *data = strchr(args, '"');
+        char *end = data ? strchr(data + 1, '"') : NULL;
+        if (!end || sscanf(args, "%lx", &address) != 1 ||
+            sscanf(end + 1, "%ld", &nr_bytes) != 1 ||
+            !valid_size(a, nr_bytes, LONG_MIN)) {
+            command_error(a, out, "Invalid command");
+            return 0;
+        }
+        *end = '\0';
+        if (heap_is_initialized(a, out) &&
+            write_sfl(a->allocated_memory, address, data + 1, nr_bytes))
+            return segmentation_fault(a, out);
+    } else if (!strcmp(command, "DUMP_MEMORY")) {
+        if (heap_is_initialized(a, out))
+            dump_memory(a->x, a->allocated_memory, out);
+    } else if (!strcmp(command, "DESTROY_HEAP")) {
+        if (a->server_mode) {
+            if (heap_is_initialized(a, out))
+                destroy_heap(a);
+            return 0;
+        }
+        return 1;
+    } else {
+        command_error(a, out, "Invalid command");
+    }
+    return 0;
+}
+
+// Command handler for the server mode, server.h frames its output
+void serve_command(void *ctx, char *line, FILE *out)
+{
+    execute_command(ctx, line, out);
+}
+
+// Read the next command from stdin the way the original program did: as
+//      whitespace-separated tokens, so a command may span several lines and
+//      a line may hold several commands. WRITE takes the rest of its line
+// The command and its arguments are joined into line for execute_command()
+// Returns 0 at the end of the input
+int read_stdin_command(char *line, int size)
+{
+    // A token is at most MAX_COMMAND_LENGTH - 1 characters long
+    char token[MAX_COMMAND_LENGTH];
+    if (scanf("%99s", token) != 1)
+        return 0;
+    strcpy(line, token);
+
+    int nr_arguments = 0, is_write = !strcmp(token, "WRITE");
+    if (!strcmp(token, "INIT_HEAP"))
+        nr_arguments = 4;
+    else if (!strcmp(token, "READ"))
+        nr_arguments = 2;
+    else if (!strcmp(token, "MALLOC") || !strcmp(token, "FREE") || is_write)
+        nr_arguments = 1;
+
+    for (int i = 0; i < nr_arguments && scanf("%99s", token) == 1; i++) {
+        strcat(line, " ");
+        strcat(line, token);
+    }
+
+    // The data of WRITE is quoted and may contain whitespace
+    int length = strlen(line);
+    if (is_write && !fgets(line + length, size - length, stdin))
+        line[length] = '\0';
+    return 1;
+}
+
+// Run as "./sfl" to read commands from stdin, or as
+//      "./sfl --server <socket path>" to serve them over a Unix domain socket
+int main(int argc, char *argv[])
+{
+	int server_mode = argc > 1 && !strcmp(argv[1], "--server");
+	if (server_mode && argc != 3) {
+		fprintf(stderr, "Usage: %s [--server <socket path>]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	allocator *a = new_allocator(server_mode);
+
+	if (a->server_mode) {
+		int result = run_server(argv[2], serve_command, a);
+		free_allocator(a);
+		return result ? EXIT_FAILURE : EXIT_SUCCESS;
 	}
 
+	char line[MAX_LINE_LENGTH];
+	while (read_stdin_command(line, MAX_LINE_LENGTH))
+		if (execute_command(a, line, stdout))
+			break;
+
 	// Free auxiliary memory
-	free(command);
-	free_list(allocated_memory, 1);
-	free_sfl(x);
+	free_allocator(a);
+	return EXIT_SUCCESS;
 }
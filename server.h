@@ -0,0 +1,456 @@
+// Copyright Filip Popa ~ ACS 313CAb
+
+// The library used by the server mode of sfl: an epoll event loop which
+//      keeps the process resident and accepts clients on a Unix domain socket
+// Requests are newline-terminated text lines, which keep the syntax of the
+//      commands read from stdin. Every complete line received by one read()
+//      is executed as a batch, and the responses of the whole batch are sent
+//      back to the client with a single send()
+// Every response starts with the length of the output of its command, as a
+//      fixed-width decimal number on a line of its own. The fixed width lets
+//      the output be written right after a placeholder for the length,
+//      which is filled in once the command has finished
+// It needs POSIX.1-2008 (open_memstream(), sigaction(), MSG_NOSIGNAL), which
+//      the Makefile requests for every file with -D_POSIX_C_SOURCE=200809L
+#if !defined(_POSIX_C_SOURCE) || _POSIX_C_SOURCE < 200809L
+#error "server.h needs _POSIX_C_SOURCE >= 200809L, see the Makefile"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#define SERVER_MAX_EVENTS 64
+#define SERVER_READ_CHUNK 65536
+// A client which sends this many bytes without a newline is disconnected
+#define SERVER_MAX_LINE_LENGTH (1 << 20)
+#define SERVER_LENGTH_WIDTH 10
+// A batch stops once its responses take this many bytes, and the rest of
+//      its lines are executed after the responses have been sent
+#define SERVER_MAX_PENDING (4 << 20)
+
+// The command handler executes one request line (without its '\n')
+//      and writes the output of the command to out
+typedef void (*command_handler)(void *ctx, char *line, FILE *out);
+
+typedef struct client client;
+
+// A connected client: its socket, the bytes received and not executed yet
+//      (the first complete ones are complete lines) and the part of the
+//      last response that has not been sent yet
+// Nothing else is read from the client until all its complete lines have
+//      been executed and all their responses have been sent
+// After the client has finished sending (eof), it is disconnected once
+//      everything it sent has been answered
+struct client {
+    int fd, eof;
+    uint32_t events;
+    char *in;
+    size_t in_len, in_capacity, complete;
+    char *pending;
+    size_t pending_len, pending_sent;
+    client *prev, *next;
+};
+
+// Set by SIGINT / SIGTERM to stop the event loop
+volatile sig_atomic_t server_stop;
+
+void server_on_signal(int sig)
+{
+    (void)sig;
+    server_stop = 1;
+}
+
+int set_nonblocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL);
+    if (flags < 0)
+        return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+// Check that nothing useful exists at the socket path, removing a stale
+//      socket file left by a server which is not running anymore
+// Returns 0 if the path is free to be bound, -1 otherwise
+int claim_socket_path(const char *path, struct sockaddr_un *address)
+{
+    struct stat st;
+    if (lstat(path, &st) < 0)
+        return errno == ENOENT ? 0 : -1;
+    if (!S_ISSOCK(st.st_mode)) {
+        fprintf(stderr, "%s exists and is not a socket\n", path);
+        return -1;
+    }
+
+    // Only a socket which refuses connections is stale
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    int result = connect(fd, (struct sockaddr *)address, sizeof(*address));
+    int error = errno;
+    close(fd);
+    if (result == 0) {
+        fprintf(stderr, "Another server is listening on %s\n", path);
+        return -1;
+    }
+    if (error != ECONNREFUSED) {
+        errno = error;
+        perror(path);
+        return -1;
+    }
+    return unlink(path);
+}
+
+// Create the listening socket at path, replacing a stale socket file left by
+//      a previous run. Returns its file descriptor or -1 on error
+int server_listen(const char *path)
+{
+    struct sockaddr_un address;
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        return -1;
+    }
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path);
+
+    if (claim_socket_path(path, &address) < 0)
+        return -1;
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    if (bind(fd, (struct sockaddr *)&address, sizeof(address)) < 0 ||
+        listen(fd, SOMAXCONN) < 0 || set_nonblocking(fd) < 0) {
+        perror(path);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// The state of the event loop
+typedef struct {
+    int epoll_fd, listen_fd;
+    int reserve_fd; // Kept open for when the server runs out of descriptors
+    int listening;  // 0 while the listening socket is removed from epoll
+    client *clients;
+} server_state;
+
+// Watch the listening socket again, after it was removed from epoll
+//      because the server ran out of file descriptors
+void start_listening(server_state *state)
+{
+    struct epoll_event event = {.events = EPOLLIN, .data.ptr = NULL};
+    if (!epoll_ctl(state->epoll_fd, EPOLL_CTL_ADD, state->listen_fd, &event))
+        state->listening = 1;
+}
+
+// Remove a client from the list of clients, close its socket
+//      (which also removes it from epoll) and free its memory
+// The descriptor freed lets the server accept connections again
+void drop_client(server_state *state, client *c)
+{
+    if (state->clients == c)
+        state->clients = c->next;
+    if (c->prev)
+        c->prev->next = c->next;
+    if (c->next)
+        c->next->prev = c->prev;
+    close(c->fd);
+    free(c->in);
+    free(c->pending);
+    free(c);
+    if (!state->listening)
+        start_listening(state);
+}
+
+// Accept every waiting connection and register it in epoll
+void accept_clients(server_state *state)
+{
+    while (1) {
+        if (state->reserve_fd < 0)
+            state->reserve_fd = open("/dev/null", O_RDONLY);
+        int fd = accept(state->listen_fd, NULL, NULL);
+        if (fd < 0 && (errno == EINTR || errno == ECONNABORTED))
+            continue;
+
+        // Without free file descriptors the connection stays queued and the
+        //      listening socket stays readable, so epoll_wait() would spin
+        // Use the reserved descriptor to accept the connection and close it,
+        //      or if there is none, stop watching the listening socket
+        //      until a client is disconnected
+        if (fd < 0 && (errno == EMFILE || errno == ENFILE)) {
+            if (state->reserve_fd >= 0) {
+                close(state->reserve_fd);
+                state->reserve_fd = -1;
+                fd = accept(state->listen_fd, NULL, NULL);
+                if (fd >= 0) {
+                    close(fd);
+                    continue;
+                }
+            }
+            if (fd < 0 && errno != EAGAIN && errno != EWOULDBLOCK &&
+                !epoll_ctl(state->epoll_fd, EPOLL_CTL_DEL, state->listen_fd,
+                           NULL))
+                state->listening = 0;
+            return;
+        }
+        if (fd < 0)
+            return;
+
+        client *c = calloc(1, sizeof(client));
+        struct epoll_event event = {.events = EPOLLIN, .data.ptr = c};
+        if (c)
+            c->events = EPOLLIN;
+        if (!c || set_nonblocking(fd) < 0 ||
+            epoll_ctl(state->epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+            free(c);
+            close(fd);
+            continue;
+        }
+        c->fd = fd;
+        c->next = state->clients;
+        if (state->clients)
+            state->clients->prev = c;
+        state->clients = c;
+    }
+}
+
+// Send as much of the pending response as the socket accepts
+// Returns -1 if the connection is broken, 0 otherwise
+int flush_client(client *c)
+{
+    while (c->pending_sent < c->pending_len) {
+        ssize_t s = send(c->fd, c->pending + c->pending_sent,
+                         c->pending_len - c->pending_sent, MSG_NOSIGNAL);
+        if (s < 0)
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        c->pending_sent += s;
+    }
+    free(c->pending);
+    c->pending = NULL;
+    c->pending_len = 0;
+    c->pending_sent = 0;
+    return 0;
+}
+
+// Execute the len bytes of complete lines from batch, writing the framed
+//      responses to out, until they take SERVER_MAX_PENDING bytes
+// Empty lines are ignored and get no response
+// Returns the number of bytes executed or -1 if out could not be written
+long run_batch(char *batch, size_t len, command_handler handle, void *ctx,
+               FILE *out)
+{
+    char *line = batch, *end = batch + len;
+    while (line < end) {
+        // The batch always ends with '\n', so eol is never NULL
+        char *eol = memchr(line, '\n', end - line);
+        *eol = '\0';
+        if (eol > line && eol[-1] == '\r')
+            eol[-1] = '\0';
+
+        long stop = ftell(out);
+        if (line[strspn(line, " \t\r")] != '\0') {
+            long header = stop;
+            fprintf(out, "%0*d\n", SERVER_LENGTH_WIDTH, 0);
+            long start = ftell(out);
+            handle(ctx, line, out);
+            stop = ftell(out);
+            if (header < 0 || start < 0 || stop < 0 ||
+                fseek(out, header, SEEK_SET) < 0)
+                return -1;
+            fprintf(out, "%0*ld\n", SERVER_LENGTH_WIDTH, stop - start);
+            if (fseek(out, stop, SEEK_SET) < 0)
+                return -1;
+        }
+        line = eol + 1;
+        if (stop >= SERVER_MAX_PENDING)
+            break;
+    }
+    return ferror(out) ? -1 : line - batch;
+}
+
+// Execute the complete lines received from the client as one batch,
+//      then start sending the responses
+// Returns -1 if the client must be disconnected, 0 otherwise
+int execute_lines(client *c, command_handler handle, void *ctx)
+{
+    FILE *out = open_memstream(&c->pending, &c->pending_len);
+    if (!out)
+        return -1;
+    long executed = run_batch(c->in, c->complete, handle, ctx, out);
+    if (fclose(out) < 0 || executed < 0)
+        return -1;
+
+    // Keep the lines which were not executed yet and the incomplete line
+    c->complete -= executed;
+    c->in_len -= executed;
+    memmove(c->in, c->in + executed, c->in_len);
+    return flush_client(c);
+}
+
+// Read once from the client and execute the complete lines received
+// Returns -1 if the client must be disconnected, 0 otherwise
+int read_client(client *c, command_handler handle, void *ctx)
+{
+    // Make room for a whole chunk after the incomplete line kept in c->in
+    if (c->in_capacity - c->in_len < SERVER_READ_CHUNK) {
+        size_t capacity = c->in_len + SERVER_READ_CHUNK;
+        char *in = realloc(c->in, capacity);
+        if (!in)
+            return -1;
+        c->in = in;
+        c->in_capacity = capacity;
+    }
+
+    ssize_t s = read(c->fd, c->in + c->in_len, SERVER_READ_CHUNK);
+    if (s < 0)
+        return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+    if (s == 0) {
+        // The last line does not need a '\n' (there is always room for it)
+        c->eof = 1;
+        if (!c->in_len)
+            return -1;
+        c->in[c->in_len++] = '\n';
+        c->complete = c->in_len;
+        return execute_lines(c, handle, ctx);
+    }
+
+    // Only the new bytes may contain a newline, so search
+    //      for the end of the last complete line backwards from there
+    size_t old_len = c->in_len;
+    c->in_len += s;
+    c->complete = c->in_len;
+    while (c->complete > old_len && c->in[c->complete - 1] != '\n')
+        c->complete--;
+    if (c->complete == old_len) {
+        c->complete = 0;
+        return c->in_len < SERVER_MAX_LINE_LENGTH ? 0 : -1;
+    }
+    return execute_lines(c, handle, ctx);
+}
+
+// Do the next thing the client is waiting for: send the rest of the last
+//      response, execute the lines left from the last batch or read more
+// Returns -1 if the client must be disconnected, 0 otherwise
+int serve_client(client *c, command_handler handle, void *ctx)
+{
+    if (c->pending)
+        return flush_client(c);
+    if (c->complete)
+        return execute_lines(c, handle, ctx);
+    return read_client(c, handle, ctx);
+}
+
+// Wait for new data only when everything received has been executed and
+//      answered, otherwise wait until the socket can take more responses
+//      (which also wakes the server up to execute the lines left)
+// Returns -1 if the client must be disconnected, 0 otherwise
+int update_client_events(int epoll_fd, client *c)
+{
+    if (c->eof && !c->pending && !c->complete)
+        return -1;
+
+    uint32_t events = c->pending || c->complete ? EPOLLOUT : EPOLLIN;
+    if (events == c->events)
+        return 0;
+    c->events = events;
+    struct epoll_event event = {.events = events, .data.ptr = c};
+    return epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c->fd, &event);
+}
+
+// Serve clients on the Unix domain socket at path until SIGINT or SIGTERM
+// Returns 0 on a clean shutdown or -1 if the server could not be started
+//      or the event loop failed
+int run_server(const char *path, command_handler handle, void *ctx)
+{
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = server_on_signal;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    // SIGINT and SIGTERM are only delivered while waiting in epoll_pwait(),
+    //      so a signal can not arrive between checking server_stop and
+    //      starting to wait (the wait would not be interrupted by it)
+    sigset_t stop_signals, old_mask, wait_mask;
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGTERM);
+    sigprocmask(SIG_BLOCK, &stop_signals, &old_mask);
+    wait_mask = old_mask;
+    sigdelset(&wait_mask, SIGINT);
+    sigdelset(&wait_mask, SIGTERM);
+
+    server_state state = {.reserve_fd = -1, .clients = NULL};
+    state.listen_fd = server_listen(path);
+    if (state.listen_fd < 0) {
+        sigprocmask(SIG_SETMASK, &old_mask, NULL);
+        return -1;
+    }
+    state.epoll_fd = epoll_create1(0);
+    if (state.epoll_fd >= 0)
+        start_listening(&state);
+    if (!state.listening) {
+        perror("epoll");
+        if (state.epoll_fd >= 0)
+            close(state.epoll_fd);
+        close(state.listen_fd);
+        unlink(path);
+        sigprocmask(SIG_SETMASK, &old_mask, NULL);
+        return -1;
+    }
+
+    state.reserve_fd = open("/dev/null", O_RDONLY);
+    struct epoll_event events[SERVER_MAX_EVENTS];
+    int result = 0;
+    while (!server_stop) {
+        int n = epoll_pwait(state.epoll_fd, events, SERVER_MAX_EVENTS, -1,
+                            &wait_mask);
+        if (n < 0 && errno != EINTR) {
+            perror("epoll_pwait");
+            result = -1;
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            client *c = events[i].data.ptr;
+
+            // The listening socket is the only one registered without a client
+            if (!c) {
+                accept_clients(&state);
+                continue;
+            }
+
+            if ((events[i].events & EPOLLERR) ||
+                serve_client(c, handle, ctx) < 0 ||
+                update_client_events(state.epoll_fd, c) < 0)
+                drop_client(&state, c);
+        }
+    }
+
+    // Dropping the clients must not add the listening socket back to epoll
+    state.listening = 1;
+    while (state.clients)
+        drop_client(&state, state.clients);
+    if (state.reserve_fd >= 0)
+        close(state.reserve_fd);
+    close(state.epoll_fd);
+    close(state.listen_fd);
+    unlink(path);
+    sigprocmask(SIG_SETMASK, &old_mask, NULL);
+    return result;
+}
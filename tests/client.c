@@ -0,0 +1,82 @@
+// Copyright Filip Popa ~ ACS 313CAb
+
+// Test client for the server mode of sfl. It sends its standard input to the
+//      server in two writes, split after split_offset bytes (in the middle
+//      of a line, so the server has to keep the incomplete line between
+//      reads), then prints everything the server answers until the
+//      connection is closed
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// Send len bytes, returns -1 on error
+int send_all(int fd, const char *buffer, size_t len)
+{
+    while (len) {
+        ssize_t s = send(fd, buffer, len, 0);
+        if (s < 0)
+            return -1;
+        buffer += s;
+        len -= s;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s <socket path> <split offset>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    // Read the whole input
+    size_t len = 0, capacity = 4096;
+    char *input = malloc(capacity);
+    size_t r;
+    while ((r = fread(input + len, 1, capacity - len, stdin)) > 0) {
+        len += r;
+        if (len == capacity) {
+            capacity *= 2;
+            input = realloc(input, capacity);
+        }
+    }
+    size_t split = strtoul(argv[2], NULL, 10);
+    if (split > len)
+        split = len;
+
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, argv[1], sizeof(address.sun_path) - 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&address,
+                          sizeof(address)) < 0) {
+        perror(argv[1]);
+        free(input);
+        return EXIT_FAILURE;
+    }
+
+    // Wait between the two writes so that the server reads them separately
+    struct timespec pause = {.tv_sec = 0, .tv_nsec = 100000000};
+    if (send_all(fd, input, split) < 0 || nanosleep(&pause, NULL) < 0 ||
+        send_all(fd, input + split, len - split) < 0 ||
+        shutdown(fd, SHUT_WR) < 0) {
+        perror("send");
+        free(input);
+        close(fd);
+        return EXIT_FAILURE;
+    }
+    free(input);
+
+    // The server closes the connection after answering every line
+    char buffer[4096];
+    ssize_t s;
+    while ((s = recv(fd, buffer, sizeof(buffer), 0)) > 0)
+        fwrite(buffer, 1, s, stdout);
+    close(fd);
+    return s < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,48 @@
+#!/bin/sh
+# Copyright Filip Popa ~ ACS 313CAb
+
+# Test for the server mode: starts one ./sfl --server and sends every
+#      tests/N-server.in to it through tests/client, each over its own
+#      connection (in order, since they share the heap), then compares
+#      the length-framed responses with tests/N-server.ref
+# Every input is sent in two writes, split in the middle of its second line,
+#      so that the server has to keep an incomplete line between reads
+# tests/1-server.in has no '\n' after its last line, which must be answered too
+SOCKET=${TMPDIR:-/tmp}/sfl-test-$$.sock
+
+./sfl --server "$SOCKET" &
+SERVER=$!
+
+i=0
+while [ ! -S "$SOCKET" ] && [ $i -lt 50 ]; do
+    sleep 0.1
+    i=$((i + 1))
+done
+
+status=0
+for input in tests/*-server.in; do
+    ref=${input%.in}.ref
+    first=$(head -n 1 "$input" | wc -c)
+    second=$(sed -n 2p "$input" | wc -c)
+    if [ "$second" -lt 3 ]; then
+        echo "$input: needs a second line to split"
+        status=1
+        continue
+    fi
+    split=$((first + second / 2))
+    if ./tests/client "$SOCKET" $split < "$input" | cmp -s - "$ref"
+    then
+        echo "$input: OK"
+    else
+        echo "$input: FAILED"
+        status=1
+    fi
+done
+
+# The server must still be running, then stop cleanly on SIGTERM
+if ! kill -TERM $SERVER 2>/dev/null || ! wait $SERVER || [ -e "$SOCKET" ]
+then
+    echo "server did not stop cleanly"
+    status=1
+fi
+exit $status